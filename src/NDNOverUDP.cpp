@@ -40,6 +40,20 @@ int NDNOverUDP::begin(byte macAddress[6]) {
     _routingFreeEntryIndex = 0;
     // trick: init all to 1 to make them all free blocks
     memset((void *)_routingTable, 1, sizeof(NDNRoutingTable));
+    for (int i = 0; i < NDN_DATA_CACHE_SIZE; i++) {
+      _dataCache[i].freeBlock = true;
+    }
+    _dataCacheIndex = 0;
+    seedNonces(macAddress);
+    _adaptiveLifetime = false;
+    for (int i = 0; i < NDN_RTT_TABLE_SIZE; i++) {
+      _rttTable[i].freeBlock = true;
+    }
+    _bundleBuffer = NULL;
+    _bundleLength = 0;
+    _numOfBundleHops = 0;
+    _outBundled = false;
+    _bundleDelay = 0;
   }
   return obtainedFromDHCP;
 }
@@ -54,9 +68,34 @@ void NDNOverUDP::begin(byte macAddress[6], IPAddress ipAddress) {
   _numOfInterests = _numOfNodes = 0;
   _routingTableSize = 0;
   _routingFreeEntryIndex = 0;
+  for (int i = 0; i < NDN_DATA_CACHE_SIZE; i++) {
+    _dataCache[i].freeBlock = true;
+  }
+  _dataCacheIndex = 0;
+  seedNonces(macAddress);
+  _adaptiveLifetime = false;
+  for (int i = 0; i < NDN_RTT_TABLE_SIZE; i++) {
+    _rttTable[i].freeBlock = true;
+  }
+  _bundleBuffer = NULL;
+  _bundleLength = 0;
+  _numOfBundleHops = 0;
+  _outBundled = false;
+  _bundleDelay = 0;
+}
+
+/* seeds the random data nonces so that they differ across nodes and reboots
+ */
+void NDNOverUDP::seedNonces(byte macAddress[6]) {
+  unsigned long seed = micros() ^ analogRead(0);
+  for (int i = 0; i < 6; i++) {
+    seed = seed * 31 + macAddress[i];
+  }
+  randomSeed(seed);
 }
 
 void NDNOverUDP::stop() {
+  flushBundles(true);
   _udpIstance.stop();
   if (_nodes != NULL) {
     delete[] _nodes;
@@ -68,6 +107,10 @@ void NDNOverUDP::stop() {
     delete[] _interests;
     delete[] _interestsFunctions;
   }
+  if (_bundleBuffer != NULL) {
+    delete[] _bundleBuffer;
+    _bundleBuffer = NULL;
+  }
   delete[] _packetBuffer;
 }
 
@@ -114,24 +157,74 @@ int NDNOverUDP::publishInterests(char **names, dataProducer functions[],
   return 0;
 }
 
+/* Sets how long (in ms) outgoing packets for the same next hop are held
+   back to be bundled together in a single UDP datagram.
+   0 (the default) disables bundling, every packet is sent right away.
+*/
+void NDNOverUDP::setBundleDelay(unsigned long delay) {
+  if (!delay) {
+    flushBundles(true);
+  }
+  if (delay && _bundleBuffer == NULL) {
+    _bundleBuffer = new char[NDN_BUNDLE_BUFFER_SIZE];
+  }
+  _bundleDelay = delay;
+}
+
+/* Enables or disables adaptive interest lifetimes: interests that do not
+   carry their own lifetime stay pending for a time learnt from the
+   interest-to-data RTTs observed for their prefix instead of NDN_ROUTING_TTL.
+*/
+void NDNOverUDP::setAdaptiveLifetime(bool enabled) {
+  _adaptiveLifetime = enabled;
+}
+
+/* Pushes fresh data to the subscribers of a published interest, to be
+   called by a producer whenever the value of name changes.
+   returns:
+    0 - unsuccessful
+    1 - successful
+*/
+int NDNOverUDP::notify(const char *name) {
+  NDNDataPacket dataPkt;
+  char *content;
+  for (unsigned int i = 0; i < _numOfInterests; i++) {
+    if (strcmp(_interests[i], name) == 0) {
+      dataPkt.type = NDN_DATA_PACKET;
+      // lets the forwarders drop the copies of this push
+      dataPkt.nonce = random(1, 0x7FFFFFFF);
+      dataPkt.nameLength = strlen(_interests[i]);
+      dataPkt.name = _interests[i];
+      dataPkt.contentLength = _interestsFunctions[i](&content);
+      dataPkt.content = content;
+      forwardData(&dataPkt, NULL);
+      delete[] content;
+      return 1;
+    }
+  }
+  return 0;
+}
+
 #ifdef __ARDUINO_X86__
 /* sends an interest packet to all the NDN nodes (simulated multicast) */
 void NDNOverUDP::multicastSendInterest(NDNInterestPacket *pkt) {
-  unsigned long ip, nonce;
-  unsigned short nameLength;
-  // already in network byte order
-  ip = Ethernet.localIP()._sin.sin_addr.s_addr;
+  unsigned long nonce;
+  unsigned short lifetime, nameLength;
+  unsigned int size = NDN_HEADER_SIZE_INTEREST + pkt->nameLength;
+  // a bundled interest is queued once for all the nodes
+  bool bundled = canBundle(size);
   nonce = htonl(pkt->nonce);
+  lifetime = htons(pkt->lifetime);
   nameLength = htons(pkt->nameLength);
-  for (int i = 0; i < _numOfNodes; i++) {
-    _udpIstance.beginPacket(_nodes[i], NDN_PORT);
+  for (unsigned int i = 0; i < (bundled ? 1 : _numOfNodes); i++) {
+    beginOutgoing(bundled ? NDN_MULTICAST_ADDR : _nodes[i], size);
     /* send the actual packet */
-    _udpIstance.write((byte *)&ip, sizeof(unsigned long));
-    _udpIstance.write((byte *)&(pkt->type), 1);
-    _udpIstance.write((byte *)&nonce, sizeof(unsigned long));
-    _udpIstance.write((byte *)&nameLength, sizeof(unsigned short));
-    _udpIstance.write((byte *)pkt->name, sizeof(char) * pkt->nameLength);
-    _udpIstance.endPacket();
+    writeOutgoing(&(pkt->type), 1);
+    writeOutgoing(&nonce, sizeof(unsigned long));
+    writeOutgoing(&lifetime, sizeof(unsigned short));
+    writeOutgoing(&nameLength, sizeof(unsigned short));
+    writeOutgoing(pkt->name, sizeof(char) * pkt->nameLength);
+    endOutgoing();
   }
 }
 #else
@@ -139,13 +232,16 @@ void NDNOverUDP::multicastSendInterest(NDNInterestPacket *pkt) {
 /* sends an interest packet to all the NDN nodes (broadcast) */
 void NDNOverUDP::broadcastSendInterest(NDNInterestPacket *pkt) {
   unsigned long nonce = htonl(pkt->nonce);
+  unsigned short lifetime = htons(pkt->lifetime);
   unsigned short nameLength = htons(pkt->nameLength);
-  _udpIstance.beginPacket(IPAddress(255, 255, 255, 255), NDN_PORT);
-  _udpIstance.write((byte *)&(pkt->type), 1);
-  _udpIstance.write((byte *)&nonce, sizeof(unsigned long));
-  _udpIstance.write((byte *)&nameLength, sizeof(unsigned short));
-  _udpIstance.write((byte *)pkt->name, sizeof(char) * pkt->nameLength);
-  _udpIstance.endPacket();
+  beginOutgoing(IPAddress(255, 255, 255, 255),
+                NDN_HEADER_SIZE_INTEREST + pkt->nameLength);
+  writeOutgoing(&(pkt->type), 1);
+  writeOutgoing(&nonce, sizeof(unsigned long));
+  writeOutgoing(&lifetime, sizeof(unsigned short));
+  writeOutgoing(&nameLength, sizeof(unsigned short));
+  writeOutgoing(pkt->name, sizeof(char) * pkt->nameLength);
+  endOutgoing();
 }
 #endif
 
@@ -157,57 +253,193 @@ void NDNOverUDP::sendInterest(NDNInterestPacket *packet) {
 #endif
 }
 
-void NDNOverUDP::sendData(IPAddress ipDest, char *name,
+void NDNOverUDP::sendData(IPAddress ipDest, unsigned long nonce, char *name,
                           unsigned short nameLength, char *content,
                           unsigned long contentLength) {
   NDNDataPacket dataPkt;
-  unsigned long netlong;
-  unsigned short netshort;
   dataPkt.type = NDN_DATA_PACKET;
+  dataPkt.nonce = nonce;
   dataPkt.nameLength = nameLength;
   dataPkt.name = name;
   dataPkt.contentLength = contentLength;
   dataPkt.content = content;
+  sendData(ipDest, &dataPkt);
+}
 
-  /* send the actual packet */
+void NDNOverUDP::sendData(IPAddress ipDest, NDNDataPacket *dataPkt) {
+  unsigned long netlong;
+  unsigned short netshort;
+  /* send the packet */
+  beginOutgoing(ipDest, NDN_HEADER_SIZE_DATA + dataPkt->nameLength +
+                            dataPkt->contentLength);
+  writeOutgoing(&(dataPkt->type), 1);
+  netlong = htonl(dataPkt->nonce);
+  writeOutgoing(&netlong, sizeof(unsigned long));
+  netshort = htons(dataPkt->nameLength);
+  writeOutgoing(&netshort, sizeof(unsigned short));
+  netlong = htonl(dataPkt->contentLength);
+  writeOutgoing(&netlong, sizeof(unsigned long));
+  writeOutgoing(dataPkt->name, dataPkt->nameLength);
+  writeOutgoing(dataPkt->content, dataPkt->contentLength);
+  endOutgoing();
+}
+
+/* whether a packet of the given size can be bundled */
+bool NDNOverUDP::canBundle(unsigned int size) {
+  return _bundleDelay && size + NDN_BUNDLE_TAG_SIZE +
+                                 NDN_BUNDLE_ENTRY_HEADER_SIZE <=
+                             NDN_BUNDLE_BUFFER_SIZE;
+}
+
+/* Starts an outgoing packet of the given size, the packet is queued in the
+   bundle buffer if bundling is enabled and it fits, otherwise a UDP
+   datagram is started right away */
+void NDNOverUDP::beginOutgoing(IPAddress ipDest, unsigned int size) {
+  unsigned short netshort;
+  byte hop;
+  _outBundled = false;
+  if (canBundle(size)) {
+    // make room sending everything queued so far
+    if (_bundleLength + NDN_BUNDLE_TAG_SIZE + NDN_BUNDLE_ENTRY_HEADER_SIZE +
+            size >
+        NDN_BUNDLE_BUFFER_SIZE) {
+      flushBundles(true);
+    }
+    hop = getBundleHop(ipDest);
+    if (!_bundleLength) {
+      _bundleTimestamp = millis();
+    }
+    _outBundled = true;
+    writeOutgoing(&hop, NDN_BUNDLE_TAG_SIZE);
+    netshort = htons((unsigned short)size);
+    writeOutgoing(&netshort, sizeof(unsigned short));
+    return;
+  }
   _udpIstance.beginPacket(ipDest, NDN_PORT);
 #ifdef __ARDUINO_X86__
   // already in network byte order
-  dataPkt.ip = Ethernet.localIP()._sin.sin_addr.s_addr;
-  _udpIstance.write((byte *)&(dataPkt.ip), sizeof(unsigned long));
+  unsigned long ip = Ethernet.localIP()._sin.sin_addr.s_addr;
+  _udpIstance.write((byte *)&ip, sizeof(unsigned long));
 #endif
-  _udpIstance.write((byte *)&(dataPkt.type), 1);
-  netshort = htons(dataPkt.nameLength);
-  _udpIstance.write((byte *)&netshort, sizeof(unsigned short));
-  netlong = htonl(dataPkt.contentLength);
-  _udpIstance.write((byte *)&netlong, sizeof(unsigned long));
-  _udpIstance.write((byte *)dataPkt.name, nameLength);
-  _udpIstance.write((byte *)dataPkt.content, contentLength);
-  _udpIstance.endPacket();
 }
 
-void NDNOverUDP::sendData(IPAddress ipDest, NDNDataPacket *dataPkt) {
-  unsigned long netlong;
-  unsigned short netshort;
-  /* send the packet */
+void NDNOverUDP::writeOutgoing(const void *src, unsigned int n) {
+  if (_outBundled) {
+    memcpy((void *)(_bundleBuffer + _bundleLength), src, n);
+    _bundleLength += n;
+  } else {
+    _udpIstance.write((byte *)src, n);
+  }
+}
+
+void NDNOverUDP::endOutgoing() {
+  if (_outBundled) {
+    _outBundled = false;
+  } else {
+    _udpIstance.endPacket();
+  }
+}
+
+/* returns the index of ipDest among the next hops with queued packets, when
+   there are already too many of them everything queued is sent first */
+byte NDNOverUDP::getBundleHop(IPAddress ipDest) {
+  for (byte i = 0; i < _numOfBundleHops; i++) {
+    if (_bundleHops[i] == ipDest) {
+      return i;
+    }
+  }
+  if (_numOfBundleHops == NDN_BUNDLE_TABLE_SIZE) {
+    flushBundles(true);
+  }
+  _bundleHops[_numOfBundleHops] = ipDest;
+  return _numOfBundleHops++;
+}
+
+/* sends the packets queued for a next hop in a single UDP datagram */
+void NDNOverUDP::sendBundle(IPAddress ipDest, byte hop) {
+  byte type = NDN_BUNDLE_PACKET;
+  byte count = 0;
+  unsigned short packetLength;
+  unsigned int i, first = 0;
+  // the packets of a next hop are scattered in the buffer, count them first
+  for (i = 0; i < _bundleLength;
+       i += NDN_BUNDLE_TAG_SIZE + NDN_BUNDLE_ENTRY_HEADER_SIZE + packetLength) {
+    memcpy((void *)&packetLength, (void *)(_bundleBuffer + i + 1),
+           sizeof(unsigned short));
+    packetLength = ntohs(packetLength);
+    if ((byte)_bundleBuffer[i] == hop && !count++) {
+      first = i;
+    }
+  }
   _udpIstance.beginPacket(ipDest, NDN_PORT);
 #ifdef __ARDUINO_X86__
   // already in network byte order
-  dataPkt->ip = Ethernet.localIP()._sin.sin_addr.s_addr;
-  _udpIstance.write((byte *)&(dataPkt->ip), sizeof(unsigned long));
+  unsigned long ip = Ethernet.localIP()._sin.sin_addr.s_addr;
+  _udpIstance.write((byte *)&ip, sizeof(unsigned long));
 #endif
-  _udpIstance.write((byte *)&(dataPkt->type), 1);
-  netshort = htons(dataPkt->nameLength);
-  _udpIstance.write((byte *)&netshort, sizeof(unsigned short));
-  netlong = htonl(dataPkt->contentLength);
-  _udpIstance.write((byte *)&netlong, sizeof(unsigned long));
-  _udpIstance.write((byte *)dataPkt->name, dataPkt->nameLength);
-  _udpIstance.write((byte *)dataPkt->content, dataPkt->contentLength);
+  if (count == 1) {
+    // no point in bundling a lonely packet, just strip its tag and length
+    memcpy((void *)&packetLength, (void *)(_bundleBuffer + first + 1),
+           sizeof(unsigned short));
+    _udpIstance.write((byte *)_bundleBuffer + first + NDN_BUNDLE_TAG_SIZE +
+                          NDN_BUNDLE_ENTRY_HEADER_SIZE,
+                      ntohs(packetLength));
+  } else {
+    _udpIstance.write(&type, 1);
+    _udpIstance.write(&count, 1);
+    for (i = first; i < _bundleLength; i += NDN_BUNDLE_TAG_SIZE +
+                                             NDN_BUNDLE_ENTRY_HEADER_SIZE +
+                                             packetLength) {
+      memcpy((void *)&packetLength, (void *)(_bundleBuffer + i + 1),
+             sizeof(unsigned short));
+      packetLength = ntohs(packetLength);
+      if ((byte)_bundleBuffer[i] == hop) {
+        _udpIstance.write((byte *)_bundleBuffer + i + NDN_BUNDLE_TAG_SIZE,
+                          NDN_BUNDLE_ENTRY_HEADER_SIZE + packetLength);
+      }
+    }
+  }
   _udpIstance.endPacket();
 }
 
-void NDNOverUDP::receiveData(char *packetBuffer, NDNDataPacket *dataPkt) {
+/* sends a bundle to every next hop once the first queued packet is older
+   than the bundling delay, or right away if forced */
+void NDNOverUDP::flushBundles(bool force) {
+  if (!_bundleLength ||
+      (!force && (millis() - _bundleTimestamp) < _bundleDelay)) {
+    return;
+  }
+  for (byte hop = 0; hop < _numOfBundleHops; hop++) {
+#ifdef __ARDUINO_X86__
+    if (_bundleHops[hop] == NDN_MULTICAST_ADDR) {
+      for (unsigned int i = 0; i < _numOfNodes; i++) {
+        sendBundle(_nodes[i], hop);
+      }
+      continue;
+    }
+#endif
+    sendBundle(_bundleHops[hop], hop);
+  }
+  _bundleLength = 0;
+  _numOfBundleHops = 0;
+}
+
+/* parses a data packet (without its type) of the given length
+   returns:
+    false - the packet is malformed, nothing has been allocated
+    true - successful
+*/
+bool NDNOverUDP::receiveData(char *packetBuffer, int length,
+                             NDNDataPacket *dataPkt) {
+  if (length < NDN_HEADER_SIZE_DATA - 1) {
+    return false;
+  }
+  length -= NDN_HEADER_SIZE_DATA - 1;
   /* process the packet header*/
+  memcpy((void *)&(dataPkt->nonce), (void *)packetBuffer,
+         sizeof(unsigned long));
+  dataPkt->nonce = ntohl(dataPkt->nonce);
+  packetBuffer += sizeof(unsigned long);
   memcpy((void *)&(dataPkt->nameLength), (void *)packetBuffer,
          sizeof(unsigned short));
   dataPkt->nameLength = ntohs(dataPkt->nameLength);
@@ -216,6 +448,10 @@ void NDNOverUDP::receiveData(char *packetBuffer, NDNDataPacket *dataPkt) {
          sizeof(unsigned long));
   dataPkt->contentLength = ntohl(dataPkt->contentLength);
   packetBuffer += sizeof(unsigned long);
+  if (dataPkt->nameLength > length ||
+      dataPkt->contentLength > (unsigned long)(length - dataPkt->nameLength)) {
+    return false;
+  }
 
   /* payload */
   dataPkt->name = new char[dataPkt->nameLength];
@@ -224,23 +460,77 @@ void NDNOverUDP::receiveData(char *packetBuffer, NDNDataPacket *dataPkt) {
   dataPkt->content = (char *)new byte[dataPkt->contentLength];
   memcpy((void *)dataPkt->content, (void *)packetBuffer,
          dataPkt->contentLength);
+  return true;
 }
 
-void NDNOverUDP::receiveInterest(char *packetBuffer,
+/* parses an interest packet (without its type) of the given length
+   returns:
+    false - the packet is malformed, nothing has been allocated
+    true - successful
+*/
+bool NDNOverUDP::receiveInterest(char *packetBuffer, int length,
                                  NDNInterestPacket *interestPkt) {
+  if (length < NDN_HEADER_SIZE_INTEREST - 1) {
+    return false;
+  }
+  length -= NDN_HEADER_SIZE_INTEREST - 1;
   /* process the packet header */
   memcpy((void *)&(interestPkt->nonce), (void *)packetBuffer,
          sizeof(unsigned long));
   interestPkt->nonce = ntohl(interestPkt->nonce);
   packetBuffer += sizeof(unsigned long);
+  memcpy((void *)&(interestPkt->lifetime), (void *)packetBuffer,
+         sizeof(unsigned short));
+  interestPkt->lifetime = ntohs(interestPkt->lifetime);
+  packetBuffer += sizeof(unsigned short);
   memcpy((void *)&(interestPkt->nameLength), (void *)packetBuffer,
          sizeof(unsigned short));
   interestPkt->nameLength = ntohs(interestPkt->nameLength);
   packetBuffer += sizeof(unsigned short);
+  if (interestPkt->nameLength > length) {
+    return false;
+  }
   /* payload */
   interestPkt->name = new char[interestPkt->nameLength];
   memcpy((void *)(interestPkt->name), (void *)packetBuffer,
          interestPkt->nameLength);
+  return true;
+}
+
+/* unpacks a bundle and processes every packet it carries */
+void NDNOverUDP::receiveBundle(char *packetBuffer, int length) {
+  byte count;
+  unsigned short packetLength;
+  if (length < 1) {
+    Serial.println("Malformed bundle dropped");
+    return;
+  }
+  count = (byte)*packetBuffer;
+  packetBuffer++;
+  length--;
+  for (int i = 0; i < count; i++) {
+    if (length < NDN_BUNDLE_ENTRY_HEADER_SIZE) {
+      Serial.println("Malformed bundle dropped");
+      return;
+    }
+    memcpy((void *)&packetLength, (void *)packetBuffer,
+           sizeof(unsigned short));
+    packetLength = ntohs(packetLength);
+    packetBuffer += sizeof(unsigned short);
+    length -= sizeof(unsigned short);
+    if (packetLength == 0 || packetLength > length) {
+      Serial.println("Malformed bundle dropped");
+      return;
+    }
+    // bundles cannot be nested
+    if ((byte)*packetBuffer == NDN_BUNDLE_PACKET) {
+      Serial.println("Nested bundle dropped");
+    } else {
+      processPacket(packetBuffer, packetLength);
+    }
+    packetBuffer += packetLength;
+    length -= packetLength;
+  }
 }
 
 void NDNOverUDP::freeInterestPacket(NDNInterestPacket *pkt) {
@@ -262,6 +552,8 @@ void NDNOverUDP::dumpInterestPacket(NDNInterestPacket *pkt) {
 #endif
   Serial.print("\tNonce: 0x");
   Serial.println(pkt->nonce, HEX);
+  Serial.print("\tLifetime: ");
+  Serial.println(pkt->lifetime);
   Serial.print("\tNameLength: ");
   Serial.println(pkt->nameLength);
 
@@ -281,6 +573,8 @@ void NDNOverUDP::dumpDataPacket(NDNDataPacket *pkt) {
   Serial.print("Data sender: ");
   Serial.println(IPAddress(pkt->ip));
 #endif
+  Serial.print("\tNonce: 0x");
+  Serial.println(pkt->nonce, HEX);
   Serial.print("\tNameLength: ");
   Serial.println(pkt->nameLength);
   Serial.print("\tContentLenght: ");
@@ -338,49 +632,58 @@ bool NDNOverUDP::inRoutingTable(char *name, uint16_t nameLength,
 }
 
 bool NDNOverUDP::setRoute(NDNInterestPacket *pkt) {
-  if (_routingFreeEntryIndex == _routingTableSize &&
-      _routingTableSize == NDN_ROUTING_TABLE_SIZE) {
+  NDNRouteEntry *route;
+  IPAddress ip;
+#ifdef __ARDUINO_X86__
+  ip = IPAddress(pkt->ip);
+#else
+  ip = _udpIstance.remoteIP();
+#endif
+  if (inRoutingTable(pkt->name, pkt->nameLength, pkt->nonce)) {
     return false;
   }
-  if (inRoutingTable(pkt->name, pkt->nameLength, pkt->nonce)) {
+  // a subscription renewal just extends the lease
+  if (pkt->type == NDN_SUBSCRIBE_PACKET &&
+      (route = getSubscription(pkt->name, pkt->nameLength, &ip)) != NULL) {
+    route->nonce = pkt->nonce;
+    route->timestamp = millis();
+    setRouteLifetime(route, pkt);
+    return true;
+  }
+  if (_routingFreeEntryIndex == _routingTableSize &&
+      _routingTableSize == NDN_ROUTING_TABLE_SIZE) {
     return false;
   }
-  int i;
   spritz_hash(_routingTable[_routingFreeEntryIndex].interestHash,
               NDN_ROUTING_HASH_SIZE, (uint8_t *)pkt->name,
               (uint16_t)pkt->nameLength);
   _routingTable[_routingFreeEntryIndex].freeBlock = false;
   _routingTable[_routingFreeEntryIndex].nonce = pkt->nonce;
-#ifdef __ARDUINO_X86__
-  _routingTable[_routingFreeEntryIndex].ip = IPAddress(pkt->ip);
-#else
-  _routingTable[_routingFreeEntryIndex].ip = _udpIstance.remoteIP();
-#endif
+  _routingTable[_routingFreeEntryIndex].ip = ip;
+  _routingTable[_routingFreeEntryIndex].persistent =
+      (pkt->type == NDN_SUBSCRIBE_PACKET);
+  _routingTable[_routingFreeEntryIndex].upstream = false;
   _routingTable[_routingFreeEntryIndex].timestamp = millis();
+  setRouteLifetime(&_routingTable[_routingFreeEntryIndex], pkt);
   // set _routingTableSize and _routingFreeEntryIndex
-  for (i = 0; i < _routingTableSize; i++) {
-    if (_routingTable[i].freeBlock) {
-      break;
-    }
-  }
-  if (_routingTableSize != NDN_ROUTING_TABLE_SIZE) {
-    // no gaps
-    if (i == _routingTableSize) {
-      _routingTableSize++;
-      _routingFreeEntryIndex = _routingTableSize;
-    } else {
-      _routingFreeEntryIndex = i; // gap found
-    }
+  if (_routingFreeEntryIndex == _routingTableSize) {
+    _routingTableSize++;
   }
+  updateRoutingTable();
   return true;
 }
 
-NDNRouteEntry *NDNOverUDP::getRoute(char *name, uint16_t nameLength) {
+/* returns the live subscription to name of the node ip, or the one keeping
+   the upstream subscription alive when ip is NULL */
+NDNRouteEntry *NDNOverUDP::getSubscription(char *name, uint16_t nameLength,
+                                            IPAddress *ip) {
   uint8_t nameHash[NDN_ROUTING_HASH_SIZE];
   spritz_hash(nameHash, NDN_ROUTING_HASH_SIZE, (uint8_t *)name, nameLength);
   for (int i = 0; i < _routingTableSize; i++) {
     // match
-    if (!_routingTable[i].freeBlock &&
+    if (!_routingTable[i].freeBlock && _routingTable[i].persistent &&
+        (ip == NULL ? _routingTable[i].upstream
+                    : _routingTable[i].ip == *ip) &&
         !spritz_compare(_routingTable[i].interestHash, nameHash,
                         NDN_ROUTING_HASH_SIZE)) {
       return &_routingTable[i];
@@ -389,42 +692,217 @@ NDNRouteEntry *NDNOverUDP::getRoute(char *name, uint16_t nameLength) {
   return NULL;
 }
 
-void NDNOverUDP::deleteRoute(char *name, uint16_t nameLength) {
+void NDNOverUDP::freeRoute(int i) {
+  _routingTable[i].freeBlock = true;
+  updateRoutingTable();
+}
+
+/* from now on the renewals of route keep the upstream subscription alive */
+void NDNOverUDP::setUpstreamSubscription(NDNRouteEntry *route) {
+  for (int i = 0; i < _routingTableSize; i++) {
+    if (!_routingTable[i].freeBlock && _routingTable[i].persistent &&
+        !spritz_compare(_routingTable[i].interestHash, route->interestHash,
+                        NDN_ROUTING_HASH_SIZE)) {
+      _routingTable[i].upstream = (&_routingTable[i] == route);
+    }
+  }
+}
+
+/* whether the data has already been forwarded, if not it is remembered */
+bool NDNOverUDP::inDataCache(uint8_t *nameHash, unsigned long nonce) {
+  for (int i = 0; i < NDN_DATA_CACHE_SIZE; i++) {
+    if (!_dataCache[i].freeBlock && _dataCache[i].nonce == nonce &&
+        !spritz_compare(_dataCache[i].nameHash, nameHash,
+                        NDN_DATA_CACHE_HASH_SIZE)) {
+      return true;
+    }
+  }
+  _dataCache[_dataCacheIndex].freeBlock = false;
+  _dataCache[_dataCacheIndex].nonce = nonce;
+  memcpy((void *)_dataCache[_dataCacheIndex].nameHash, (void *)nameHash,
+         NDN_DATA_CACHE_HASH_SIZE);
+  _dataCacheIndex = (_dataCacheIndex + 1) % NDN_DATA_CACHE_SIZE;
+  return false;
+}
+
+/* forwards a data packet once to every node which asked for it but its
+   sender (NULL if produced here), pending interests are satisfied and
+   removed while subscriptions are kept, copies of an already forwarded data
+   (e.g. a push going round a loop) are dropped */
+void NDNOverUDP::forwardData(NDNDataPacket *dataPkt, IPAddress *sender) {
   uint8_t nameHash[NDN_ROUTING_HASH_SIZE];
-  spritz_hash(nameHash, NDN_ROUTING_HASH_SIZE, (uint8_t *)name, nameLength);
+  IPAddress forwarded[NDN_ROUTING_TABLE_SIZE];
+  int numOfForwarded = 0;
+  bool sampled = false;
+  spritz_hash(nameHash, NDN_ROUTING_HASH_SIZE, (uint8_t *)dataPkt->name,
+              dataPkt->nameLength);
+  if (inDataCache(nameHash, dataPkt->nonce)) {
+    Serial.println("Duplicate data dropped");
+    return;
+  }
   for (int i = 0; i < _routingTableSize; i++) {
     // match
     if (!_routingTable[i].freeBlock &&
         !spritz_compare(_routingTable[i].interestHash, nameHash,
                         NDN_ROUTING_HASH_SIZE)) {
-      _routingTable[i].freeBlock = true;
-      if (i == (_routingTableSize - 1)) {
-        _routingFreeEntryIndex = i;
-        _routingTableSize--;
-      } else {
-        _routingFreeEntryIndex = i; // gap found
+      // never send data back where it came from
+      bool forward = (sender == NULL || !(_routingTable[i].ip == *sender));
+      for (int k = 0; k < numOfForwarded; k++) {
+        if (forwarded[k] == _routingTable[i].ip) {
+          forward = false;
+          break;
+        }
+      }
+      if (forward) {
+        sendData(_routingTable[i].ip, dataPkt);
+        forwarded[numOfForwarded++] = _routingTable[i].ip;
+        Serial.println("Packet data forwarded");
+      }
+      if (!_routingTable[i].persistent) {
+        // a subscription timestamp is its last renewal, not a RTT sample
+        if (_adaptiveLifetime && !sampled) {
+          updateRtt(dataPkt->name, dataPkt->nameLength,
+                    millis() - _routingTable[i].timestamp);
+          sampled = true;
+        }
+        freeRoute(i);
       }
-      return;
     }
   }
 }
 
 void NDNOverUDP::dropExpiredInterest() {
-  int lastFreeBlock = -1;
-  if (_routingTableSize > 0) {
-    for (int i = _routingTableSize - 1; i > -1; i--) {
-      if (!_routingTable[i].freeBlock &&
-          (millis() - _routingTable[i].timestamp) > NDN_ROUTING_TTL) {
-        _routingTable[i].freeBlock = true;
-        _routingFreeEntryIndex = i;
-        if (i > lastFreeBlock) {
-          lastFreeBlock = i;
+  unsigned long backoff;
+  for (int i = 0; i < _routingTableSize; i++) {
+    if (!_routingTable[i].freeBlock &&
+        (millis() - _routingTable[i].timestamp) > _routingTable[i].lifetime) {
+      _routingTable[i].freeBlock = true;
+      // the learnt lifetime was too short, back off like TCP does
+      if (_routingTable[i].rttIndex != NDN_RTT_NONE) {
+        NDNRttEntry *rtt = &_rttTable[_routingTable[i].rttIndex];
+        backoff = _routingTable[i].lifetime * 2UL;
+        if (backoff > NDN_ROUTING_TTL) {
+          backoff = NDN_ROUTING_TTL;
+        }
+        if (backoff > rtt->srtt) {
+          rtt->srtt = backoff;
         }
       }
     }
-    _routingTableSize =
-        (lastFreeBlock != -1) ? lastFreeBlock : _routingTableSize;
   }
+  updateRoutingTable();
+}
+
+/* shrinks the routing table past its trailing free entries and points
+   _routingFreeEntryIndex to the lowest free entry, entries can expire in
+   any order since each one has its own lifetime */
+void NDNOverUDP::updateRoutingTable() {
+  while (_routingTableSize &&
+         _routingTable[_routingTableSize - 1].freeBlock) {
+    _routingTableSize--;
+  }
+  for (_routingFreeEntryIndex = 0;
+       _routingFreeEntryIndex < _routingTableSize;
+       _routingFreeEntryIndex++) {
+    if (_routingTable[_routingFreeEntryIndex].freeBlock) {
+      break;
+    }
+  }
+}
+
+/* sets how long an interest stays in the routing table, its own lifetime if
+   it carries one, otherwise the one learnt for its prefix or NDN_ROUTING_TTL,
+   subscriptions stay for their lease */
+void NDNOverUDP::setRouteLifetime(NDNRouteEntry *route,
+                                  NDNInterestPacket *pkt) {
+  NDNRttEntry *rtt;
+  unsigned long lifetime;
+  route->rttIndex = NDN_RTT_NONE;
+  route->lifetime = NDN_ROUTING_TTL;
+  if (pkt->type == NDN_SUBSCRIBE_PACKET) {
+    route->lifetime = pkt->lifetime ? pkt->lifetime : NDN_SUBSCRIPTION_LEASE;
+  } else if (pkt->lifetime) {
+    route->lifetime = pkt->lifetime;
+  } else if (_adaptiveLifetime &&
+             (rtt = getRtt(pkt->name, pkt->nameLength)) != NULL) {
+    // same as TCP retransmission timeout
+    lifetime = (unsigned long)rtt->srtt + 4 * (unsigned long)rtt->rttvar;
+    if (lifetime < NDN_RTT_MIN_LIFETIME) {
+      lifetime = NDN_RTT_MIN_LIFETIME;
+    } else if (lifetime > NDN_ROUTING_TTL) {
+      lifetime = NDN_ROUTING_TTL;
+    }
+    route->lifetime = (unsigned short)lifetime;
+    route->rttIndex = rtt - _rttTable;
+  }
+}
+
+/* Adaptive lifetime functions */
+
+/* the prefix of /home/temp is /home, a name with no parent is its own prefix
+ */
+uint16_t NDNOverUDP::prefixLength(char *name, uint16_t nameLength) {
+  for (int i = nameLength - 1; i > 0; i--) {
+    if (name[i] == '/') {
+      return i;
+    }
+  }
+  return nameLength;
+}
+
+NDNRttEntry *NDNOverUDP::getRtt(char *name, uint16_t nameLength) {
+  uint8_t prefixHash[NDN_ROUTING_HASH_SIZE];
+  spritz_hash(prefixHash, NDN_ROUTING_HASH_SIZE, (uint8_t *)name,
+              prefixLength(name, nameLength));
+  for (int i = 0; i < NDN_RTT_TABLE_SIZE; i++) {
+    // match
+    if (!_rttTable[i].freeBlock &&
+        !spritz_compare(_rttTable[i].prefixHash, prefixHash,
+                        NDN_ROUTING_HASH_SIZE)) {
+      return &_rttTable[i];
+    }
+  }
+  return NULL;
+}
+
+/* adds an interest-to-data RTT sample to the estimate of the name prefix,
+   the least recently sampled prefix is replaced when the table is full */
+void NDNOverUDP::updateRtt(char *name, uint16_t nameLength,
+                           unsigned long rtt) {
+  NDNRttEntry *entry;
+  unsigned long delta;
+  if (rtt > NDN_ROUTING_TTL) {
+    rtt = NDN_ROUTING_TTL;
+  }
+  if ((entry = getRtt(name, nameLength)) != NULL) {
+    delta = (entry->srtt > rtt) ? entry->srtt - rtt : rtt - entry->srtt;
+    entry->rttvar = (3 * (unsigned long)entry->rttvar + delta) / 4;
+    entry->srtt = (7 * (unsigned long)entry->srtt + rtt) / 8;
+    entry->timestamp = millis();
+    return;
+  }
+  entry = &_rttTable[0];
+  for (int i = 0; i < NDN_RTT_TABLE_SIZE; i++) {
+    if (_rttTable[i].freeBlock) {
+      entry = &_rttTable[i];
+      break;
+    }
+    if ((long)(_rttTable[i].timestamp - entry->timestamp) < 0) {
+      entry = &_rttTable[i];
+    }
+  }
+  // routes still relying on the evicted prefix must not back it off
+  for (int i = 0; i < _routingTableSize; i++) {
+    if (_routingTable[i].rttIndex == entry - _rttTable) {
+      _routingTable[i].rttIndex = NDN_RTT_NONE;
+    }
+  }
+  spritz_hash(entry->prefixHash, NDN_ROUTING_HASH_SIZE, (uint8_t *)name,
+              prefixLength(name, nameLength));
+  entry->freeBlock = false;
+  entry->srtt = rtt;
+  entry->rttvar = rtt / 2;
+  entry->timestamp = millis();
 }
 
 void NDNOverUDP::dumpRoutingTable() {
@@ -457,106 +935,158 @@ void NDNOverUDP::dumpRoutingTable() {
       Serial.print("\tTimestamp: ");
       Serial.println(_routingTable[i].timestamp);
 
+      Serial.print("\tLifetime: ");
+      Serial.println(_routingTable[i].lifetime);
+
+      Serial.print("\tPersistent: ");
+      Serial.println(_routingTable[i].persistent);
+
       Serial.println("------------------");
     }
   }
 }
 
-void NDNOverUDP::startDaemon() {
-  Serial.print("NDN Daemon Listening on IP: ");
-  Serial.println(Ethernet.localIP());
-  while (1) {
-    int packetSize = _udpIstance.parsePacket();
-    if (packetSize) {
-      int readBytes = _udpIstance.read(_packetBuffer, UDP_BUFFER_SIZE);
-      Serial.print("Received ");
-      Serial.print(packetSize);
-      Serial.print(" bytes from ");
+/* processes a single Interest or Data packet starting at its type */
+void NDNOverUDP::processPacket(char *packetBuffer, int length) {
 #ifdef __ARDUINO_X86__
-      unsigned long addr;
-      memcpy((void *)&addr, (void *)_packetBuffer, sizeof(unsigned long));
-      _packetBuffer += sizeof(unsigned long);
-      addr = ntohl(addr);
-      _senderAddr = IPAddress(addr);
-      Serial.println(_senderAddr);
+  IPAddress sender = _senderAddr;
 #else
-      Serial.println(_udpIstance.remoteIP());
-      // is this a duplicate broadcast packet?
-      if (_udpIstance.remoteIP() == Ethernet.localIP()) {
-        Serial.println("Dropped self packet");
-        continue;
-      }
-#endif
-
-      if ((byte)*_packetBuffer == NDN_INTEREST_PACKET) {
-        char *content;
-        unsigned int contentLength;
-        NDNInterestPacket interestPkt;
-        bool dataProduced = false;
-#ifdef __ARDUINO_X86__
-        interestPkt.ip = addr;
+  IPAddress sender = _udpIstance.remoteIP();
 #endif
-        interestPkt.type = NDN_INTEREST_PACKET;
-        receiveInterest(_packetBuffer + 1, &interestPkt);
-        // dumpInterestPacket(&interestPkt);
-        // hexDump(_packetBuffer, readBytes);
-
-        // Produce data if I am the prodcer
-        for (int i = 0; i < _numOfInterests; i++) {
-          int pubIntLen = strlen(_interests[i]);
-          if (interestPkt.nameLength == pubIntLen) {
-            if (strncmp(_interests[i], interestPkt.name, pubIntLen) == 0) {
-              // match is found
-              dataProduced = true;
-              contentLength = _interestsFunctions[i](&content);
+  if ((byte)*packetBuffer == NDN_INTEREST_PACKET ||
+      (byte)*packetBuffer == NDN_SUBSCRIBE_PACKET) {
+    char *content;
+    unsigned int contentLength;
+    NDNInterestPacket interestPkt;
+    bool dataProduced = false;
 #ifdef __ARDUINO_X86__
-              sendData(_senderAddr, interestPkt.name, interestPkt.nameLength,
-                       content, contentLength);
-#else
-              sendData(_udpIstance.remoteIP(), interestPkt.name,
-                       interestPkt.nameLength, content, contentLength);
+    interestPkt.ip = _senderIp;
 #endif
-              delete[] content;
-              break;
-            }
+    interestPkt.type = (byte)*packetBuffer;
+    if (!receiveInterest(packetBuffer + 1, length - 1, &interestPkt)) {
+      Serial.println("Malformed packet dropped");
+      return;
+    }
+    // dumpInterestPacket(&interestPkt);
+
+    // Produce data if I am the prodcer
+    for (int i = 0; i < _numOfInterests; i++) {
+      int pubIntLen = strlen(_interests[i]);
+      if (interestPkt.nameLength == pubIntLen) {
+        if (strncmp(_interests[i], interestPkt.name, pubIntLen) == 0) {
+          // match is found
+          dataProduced = true;
+          // remember the subscriber to push it the next values
+          if (interestPkt.type == NDN_SUBSCRIBE_PACKET &&
+              !setRoute(&interestPkt)) {
+            Serial.println("Packet dropped");
+            break;
           }
+          contentLength = _interestsFunctions[i](&content);
+          sendData(sender, interestPkt.nonce, interestPkt.name,
+                   interestPkt.nameLength, content, contentLength);
+          delete[] content;
+          break;
         }
-        /* otherwise forward */
-        if (!dataProduced) {
-          if (setRoute(&interestPkt)) {
-            sendInterest(&interestPkt);
-          } else {
-            Serial.println("Packet dropped");
+      }
+    }
+    /* otherwise forward */
+    if (!dataProduced) {
+      bool forward = true;
+      NDNRouteEntry *route, *upstream;
+      if (interestPkt.type == NDN_SUBSCRIBE_PACKET) {
+        // subscriptions are aggregated: new ones are always forwarded to get
+        // the current value, renewals only by a single subscriber, whose
+        // duty passes to the next renewing one if it does not renew in time
+        route = getSubscription(interestPkt.name, interestPkt.nameLength,
+                                &sender);
+        upstream = getSubscription(interestPkt.name, interestPkt.nameLength,
+                                   NULL);
+        forward = (route == NULL || upstream == NULL || upstream == route ||
+                   (millis() - upstream->timestamp) > upstream->lifetime / 2);
+      }
+      if (setRoute(&interestPkt)) {
+        if (forward) {
+          if (interestPkt.type == NDN_SUBSCRIBE_PACKET) {
+            setUpstreamSubscription(getSubscription(
+                interestPkt.name, interestPkt.nameLength, &sender));
           }
+          sendInterest(&interestPkt);
         }
+      } else {
+        Serial.println("Packet dropped");
+      }
+    }
 
-        /* clean up */
-        freeInterestPacket(&interestPkt);
-      } else if ((byte)*_packetBuffer == NDN_DATA_PACKET) {
-        NDNDataPacket dataPkt;
+    /* clean up */
+    freeInterestPacket(&interestPkt);
+  } else if ((byte)*packetBuffer == NDN_DATA_PACKET) {
+    NDNDataPacket dataPkt;
 #ifdef __ARDUINO_X86__
-        dataPkt.ip = addr;
+    dataPkt.ip = _senderIp;
 #endif
-        dataPkt.type = NDN_DATA_PACKET;
-        receiveData(_packetBuffer + 1, &dataPkt);
-        // dumpDataPacket(&dataPkt);
-        // hexDump(_packetBuffer, readBytes);
-
-        // Check FIB and either forward or drop
-        NDNRouteEntry *route;
-        while ((route = getRoute(dataPkt.name, dataPkt.nameLength)) != NULL) {
-          sendData(route->ip, &dataPkt);
-          deleteRoute(dataPkt.name, dataPkt.nameLength);
-          Serial.println("Packet data forwarded");
-        }
+    dataPkt.type = NDN_DATA_PACKET;
+    if (!receiveData(packetBuffer + 1, length - 1, &dataPkt)) {
+      Serial.println("Malformed packet dropped");
+      return;
+    }
+    // dumpDataPacket(&dataPkt);
 
-        /* clean up */
-        freeDataPacket(&dataPkt);
-      } else {
-        Serial.println("Undefined Packet type");
-      }
+    // Check FIB and either forward or drop
+    forwardData(&dataPkt, &sender);
+
+    /* clean up */
+    freeDataPacket(&dataPkt);
+  } else {
+    Serial.println("Undefined Packet type");
+  }
+}
+
+void NDNOverUDP::startDaemon() {
+  Serial.print("NDN Daemon Listening on IP: ");
+  Serial.println(Ethernet.localIP());
+  while (1) {
+    processPackets();
+  }
+}
+
+/* Runs a single iteration of the daemon, it can be called from loop()
+   instead of startDaemon() when the sketch has other work to do (e.g.
+   calling notify()) */
+void NDNOverUDP::processPackets() {
+  flushBundles(false);
+  int packetSize = _udpIstance.parsePacket();
+  if (packetSize) {
+    int readBytes = _udpIstance.read(_packetBuffer, UDP_BUFFER_SIZE);
+    char *packetBuffer = _packetBuffer;
+    Serial.print("Received ");
+    Serial.print(packetSize);
+    Serial.print(" bytes from ");
+#ifdef __ARDUINO_X86__
+    unsigned long addr;
+    memcpy((void *)&addr, (void *)packetBuffer, sizeof(unsigned long));
+    packetBuffer += sizeof(unsigned long);
+    readBytes -= sizeof(unsigned long);
+    addr = ntohl(addr);
+    _senderAddr = IPAddress(addr);
+    _senderIp = addr;
+    Serial.println(_senderAddr);
+#else
+    Serial.println(_udpIstance.remoteIP());
+    // is this a duplicate broadcast packet?
+    if (_udpIstance.remoteIP() == Ethernet.localIP()) {
+      Serial.println("Dropped self packet");
+      return;
+    }
+#endif
+    // hexDump(packetBuffer, readBytes);
+
+    if ((byte)*packetBuffer == NDN_BUNDLE_PACKET) {
+      receiveBundle(packetBuffer + 1, readBytes - 1);
     } else {
-      dropExpiredInterest();
+      processPacket(packetBuffer, readBytes);
     }
+  } else {
+    dropExpiredInterest();
   }
 }
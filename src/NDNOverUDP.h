@@ -31,17 +31,40 @@
 /* NDN Packet types */
 #define NDN_INTEREST_PACKET 0x1
 #define NDN_DATA_PACKET 0x2
+#define NDN_BUNDLE_PACKET 0x3
+// same layout as an interest, its lifetime is the subscription lease
+#define NDN_SUBSCRIBE_PACKET 0x4
 
-#define NDN_HEADER_SIZE_INTEREST 0x7
-#define NDN_HEADER_SIZE_DATA 0x7
+#define NDN_HEADER_SIZE_INTEREST 0x9
+#define NDN_HEADER_SIZE_DATA 0xB
+#define NDN_HEADER_SIZE_BUNDLE 0x2
+// every packet inside a bundle is prefixed by its length
+#define NDN_BUNDLE_ENTRY_HEADER_SIZE 0x2
 
 #define UDP_BUFFER_SIZE 256 // 1KB
 
+// a bundle must fit in the receiver UDP buffer
+#ifdef __ARDUINO_X86__
+#define NDN_BUNDLE_MTU (UDP_BUFFER_SIZE - sizeof(unsigned long))
+#else
+#define NDN_BUNDLE_MTU UDP_BUFFER_SIZE
+#endif
+#define NDN_BUNDLE_BUFFER_SIZE (NDN_BUNDLE_MTU - NDN_HEADER_SIZE_BUNDLE)
+// the bundle buffer is shared by up to 8 next hops, each queued packet is
+// tagged with the index of its next hop
+#define NDN_BUNDLE_TABLE_SIZE 8
+#define NDN_BUNDLE_TAG_SIZE 0x1
+#ifdef __ARDUINO_X86__
+// interests for all the NDN nodes are bundled once and copied to each of them
+#define NDN_MULTICAST_ADDR IPAddress(255, 255, 255, 255)
+#endif
+
 // if the arduino reaches these limits it will drom any future incoming packet
 // of course until it has fullfilled some requests
 #define NDN_ROUTING_TABLE_SIZE 10 // up to 10 unique outstanding interests
 #define NDN_ROUTING_HASH_SIZE 16
 // 5 seconds of ttl, after that the pending interest gets dropped
+// used when an interest does not carry its own lifetime
 #define NDN_ROUTING_TTL 5000
 typedef struct NDNRouteEntry {
   boolean freeBlock;
@@ -49,10 +72,43 @@ typedef struct NDNRouteEntry {
   uint8_t interestHash[NDN_ROUTING_HASH_SIZE]; // hash from SpritzCipher.h
   IPAddress ip;
   unsigned long timestamp;
+  unsigned short lifetime;
+  boolean persistent; // subscriptions are kept until their lease expires
+  boolean upstream; // its renewals keep the upstream subscription alive
+  byte rttIndex; // adaptive lifetime entry in use, NDN_RTT_NONE if none
 } NDNRouteEntry;
 
+// 30 seconds of lease for subscriptions that do not ask for one
+#define NDN_SUBSCRIPTION_LEASE 30000
+
 typedef NDNRouteEntry NDNRoutingTable[NDN_ROUTING_TABLE_SIZE];
 
+// adaptive lifetimes are learnt for up to 4 prefixes
+#define NDN_RTT_TABLE_SIZE 4
+// adaptive lifetimes never go below 100 ms nor above NDN_ROUTING_TTL
+#define NDN_RTT_MIN_LIFETIME 100
+#define NDN_RTT_NONE 0xFF
+typedef struct NDNRttEntry {
+  boolean freeBlock;
+  uint8_t prefixHash[NDN_ROUTING_HASH_SIZE];
+  unsigned short srtt;   // smoothed interest-to-data RTT
+  unsigned short rttvar; // RTT variation
+  unsigned long timestamp; // last RTT sample
+} NDNRttEntry;
+
+typedef NDNRttEntry NDNRttTable[NDN_RTT_TABLE_SIZE];
+
+// the last 8 data forwarded are remembered to drop their copies
+#define NDN_DATA_CACHE_SIZE 8
+#define NDN_DATA_CACHE_HASH_SIZE 4
+typedef struct NDNDataCacheEntry {
+  boolean freeBlock;
+  unsigned long nonce;
+  uint8_t nameHash[NDN_DATA_CACHE_HASH_SIZE]; // head of the name hash
+} NDNDataCacheEntry;
+
+typedef NDNDataCacheEntry NDNDataCache[NDN_DATA_CACHE_SIZE];
+
 typedef struct __attribute__((packed)) NDNInterestPacket {
 #ifdef __ARDUINO_X86__
   /* if you are an Intel Galileo you're dumb so trust me you need this */
@@ -60,6 +116,7 @@ typedef struct __attribute__((packed)) NDNInterestPacket {
 #endif
   byte type;
   unsigned long nonce;
+  unsigned short lifetime; // ms, 0 means default lifetime or lease
   unsigned short nameLength;
   char *name;
 } NDNInterestPacket;
@@ -69,6 +126,7 @@ typedef struct __attribute__((packed)) NDNDataPacket {
   unsigned long ip;
 #endif
   byte type;
+  unsigned long nonce; // the interest one for replies, random when pushed
   unsigned short nameLength;
   unsigned long contentLength;
   char *name;
@@ -85,7 +143,11 @@ public:
   void begin(byte macAddress[6], IPAddress ipAddress);
   void stop();
   int publishInterests(char **names, dataProducer functions[], unsigned int n);
+  void setBundleDelay(unsigned long delay);
+  void setAdaptiveLifetime(bool enabled);
+  int notify(const char *name);
   void startDaemon();
+  void processPackets();
   void dumpRoutingTable();
 #ifdef __ARDUINO_X86__
   int addNDNNodes(IPAddress ipAddress[], unsigned int n);
@@ -93,26 +155,52 @@ public:
 
 private:
   void sendInterest(NDNInterestPacket *packet);
-  void sendData(IPAddress ipDest, char *name, unsigned short nameLength,
-                char *content, unsigned long contentLength);
+  void sendData(IPAddress ipDest, unsigned long nonce, char *name,
+                unsigned short nameLength, char *content,
+                unsigned long contentLength);
   void sendData(IPAddress ipDest, NDNDataPacket *dataPkt);
-  void receiveInterest(char *packetBuffer, NDNInterestPacket *interestPkt);
-  void receiveData(char *packetBuffer, NDNDataPacket *dataPkt);
+  bool receiveInterest(char *packetBuffer, int length,
+                       NDNInterestPacket *interestPkt);
+  bool receiveData(char *packetBuffer, int length, NDNDataPacket *dataPkt);
+  void receiveBundle(char *packetBuffer, int length);
+  void processPacket(char *packetBuffer, int length);
 #ifdef __ARDUINO_X86__
   void multicastSendInterest(NDNInterestPacket *pkt);
 #else
   void broadcastSendInterest(NDNInterestPacket *pkt);
 #endif
 
+  /* Outgoing packets, either sent right away or bundled */
+  bool canBundle(unsigned int size);
+  void beginOutgoing(IPAddress ipDest, unsigned int size);
+  void writeOutgoing(const void *src, unsigned int n);
+  void endOutgoing();
+  byte getBundleHop(IPAddress ipDest);
+  void sendBundle(IPAddress ipDest, byte hop);
+  void flushBundles(bool force);
+
+  static void seedNonces(byte macAddress[6]);
+
   static void freeInterestPacket(NDNInterestPacket *pkt);
   static void freeDataPacket(NDNDataPacket *pkt);
 
   /* NDN Routing Table functions */
   bool setRoute(NDNInterestPacket *pkt);
   bool inRoutingTable(char *name, uint16_t nameLength, unsigned long nonce);
-  NDNRouteEntry *getRoute(char *name, uint16_t nameLength);
-  void deleteRoute(char *name, uint16_t nameLength);
+  NDNRouteEntry *getSubscription(char *name, uint16_t nameLength,
+                                 IPAddress *ip);
+  void freeRoute(int i);
+  void setUpstreamSubscription(NDNRouteEntry *route);
+  void forwardData(NDNDataPacket *dataPkt, IPAddress *sender);
+  bool inDataCache(uint8_t *nameHash, unsigned long nonce);
   void dropExpiredInterest();
+  void updateRoutingTable();
+  void setRouteLifetime(NDNRouteEntry *route, NDNInterestPacket *pkt);
+
+  /* Adaptive lifetime functions */
+  static uint16_t prefixLength(char *name, uint16_t nameLength);
+  NDNRttEntry *getRtt(char *name, uint16_t nameLength);
+  void updateRtt(char *name, uint16_t nameLength, unsigned long rtt);
 
   /* DEBUG routines */
   static void dumpInterestPacket(NDNInterestPacket *pkt);
@@ -124,6 +212,17 @@ private:
   NDNRoutingTable _routingTable;
   byte _routingTableSize;
   byte _routingFreeEntryIndex;
+  NDNDataCache _dataCache;
+  byte _dataCacheIndex;
+  NDNRttTable _rttTable;
+  bool _adaptiveLifetime;
+  char *_bundleBuffer;
+  unsigned short _bundleLength;
+  unsigned long _bundleTimestamp; // when the first packet was queued
+  IPAddress _bundleHops[NDN_BUNDLE_TABLE_SIZE];
+  byte _numOfBundleHops;
+  bool _outBundled;
+  unsigned long _bundleDelay;
   EthernetUDP _udpIstance;
   IPAddress *_nodes;
   char *_packetBuffer;
@@ -133,6 +232,7 @@ private:
   unsigned int _numOfInterests;
 #ifdef __ARDUINO_X86__
   IPAddress _senderAddr;
+  unsigned long _senderIp;
 #endif
 };
 